@@ -0,0 +1,208 @@
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#ifdef FU_BENCH_HAVE_NVPTX
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#endif
+
+#include "InstructionMixAnalysis.h"
+#include "Transformations.h"
+#include "BalanceCache.h"
+#include "BalanceProfile.h"
+#include "BalanceFunctionalUnits.h"
+#include "SyntheticLoop.h"
+
+#include <chrono>
+#include <cstdio>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace std;
+
+/**
+ * Compile-time benchmark for the mix analysis and the balancer. Each input,
+ * either a synthetic innermost loop or an IR file given on the command line,
+ * is measured in a forked child so that the reported peak memory belongs to
+ * that input alone. Needs no GPU.
+ */
+
+static cl::list<string> InputFiles(cl::Positional, cl::desc("[<IR files>...]"));
+
+static cl::list<unsigned> Sizes("sizes", cl::CommaSeparated,
+                                cl::desc("Synthetic loop body sizes, in instructions"));
+
+static cl::opt<string> Mix("mix",
+                           cl::desc("Synthetic mix as Unit:weight pairs, e.g. Shift:4,IntMul:2,FP32:1"),
+                           cl::init("FP32:3,FP64:1,IntAdd:2,IntMul:2,Shift:2,Logic:1,Conv32:1,Conv64:1,Mem:2"));
+
+static cl::opt<unsigned> Seed("seed", cl::desc("Seed for the synthetic loop generator"), cl::init(1));
+
+static cl::opt<bool> EmitPTX("emit-ptx", cl::desc("Also time NVPTX code generation after balancing"));
+
+typedef chrono::steady_clock Clock;
+
+static double millisSince(Clock::time_point start) {
+  return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+static unsigned long countInstructions(Module &M) {
+  unsigned long count = 0;
+  for (Function &F : M)
+    for (BasicBlock &BB : F)
+      count += BB.size();
+  return count;
+}
+
+#ifdef FU_BENCH_HAVE_NVPTX
+static const char *PTXTriple = "nvptx64-nvidia-cuda";
+
+static unique_ptr<TargetMachine> createPTXTargetMachine() {
+  string err;
+  const Target *T = TargetRegistry::lookupTarget(PTXTriple, err);
+  if (!T)
+    report_fatal_error(err);
+  return unique_ptr<TargetMachine>(T->createTargetMachine(PTXTriple, "sm_35", "", TargetOptions(), None));
+}
+#endif
+
+static void runBenchmark(StringRef name, unique_ptr<Module> M) {
+#ifdef FU_BENCH_HAVE_NVPTX
+  unique_ptr<TargetMachine> TM;
+  if (EmitPTX) {
+    TM = createPTXTargetMachine();
+    M->setTargetTriple(PTXTriple);
+    M->setDataLayout(TM->createDataLayout());
+  }
+#endif
+
+  unsigned long instructions = countInstructions(*M);
+
+  Clock::time_point start = Clock::now();
+  {
+    legacy::PassManager PM;
+    PM.add(new InstructionMixAnalysis());
+    PM.run(*M);
+  }
+  double analysisTime = millisSince(start);
+
+  // Includes the analyses the balancer requires
+  start = Clock::now();
+  unsigned long iterations;
+  {
+    legacy::PassManager PM;
+    BalanceFunctionalUnits *balance = new BalanceFunctionalUnits();
+    PM.add(balance);
+    PM.run(*M);
+    iterations = balance->getNumIterations();
+  }
+  double balanceTime = millisSince(start);
+
+  double codegenTime = 0;
+#ifdef FU_BENCH_HAVE_NVPTX
+  if (EmitPTX) {
+    start = Clock::now();
+    SmallString<0> ptx;
+    raw_svector_ostream os(ptx);
+    legacy::PassManager PM;
+    if (TM->addPassesToEmitFile(PM, os, TargetMachine::CGFT_AssemblyFile))
+      report_fatal_error("NVPTX target cannot emit assembly");
+    PM.run(*M);
+    codegenTime = millisSince(start);
+  }
+#endif
+
+  outs() << name << "," << instructions << ","
+         << format("%.3f,%.3f,", analysisTime, balanceTime)
+         << iterations << "," << format("%.3f,", codegenTime);
+  outs().flush();
+}
+
+/**
+ * Runs one benchmark in a child process and completes its line with the
+ * child's peak resident set size
+ */
+template <typename Body>
+static bool measure(Body body) {
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+
+  if (pid == 0) {
+    body();
+    _exit(0);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    outs() << "failed\n";
+    outs().flush();
+    return false;
+  }
+  // Flush before the next fork, or the child would inherit the buffer
+  outs() << usage.ru_maxrss << "\n";
+  outs().flush();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Functional unit balancing compile-time benchmark\n");
+
+#ifdef FU_BENCH_HAVE_NVPTX
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+#else
+  if (EmitPTX) {
+    errs() << "This build of LLVM has no NVPTX target\n";
+    return 1;
+  }
+#endif
+
+  vector<unsigned> sizes(Sizes.begin(), Sizes.end());
+  if (sizes.empty() && InputFiles.empty())
+    sizes = {10, 100, 1000, 10000, 100000};
+
+  bool ok = true;
+  outs() << "input,instructions,analysis_ms,balance_ms,iterations,codegen_ms,peak_rss_kb\n";
+  outs().flush();
+
+  for (unsigned size : sizes) {
+    ok &= measure([&]() {
+      LLVMContext ctx;
+      unique_ptr<Module> M(new Module("synthetic", ctx));
+      if (!buildSyntheticLoop(*M, "synthetic", size, Mix, Seed + size))
+        report_fatal_error("Invalid -mix");
+      runBenchmark("synthetic-" + to_string(size), move(M));
+    });
+  }
+
+  for (const string &file : InputFiles) {
+    ok &= measure([&]() {
+      LLVMContext ctx;
+      SMDiagnostic err;
+      unique_ptr<Module> M = parseIRFile(file, err, ctx);
+      if (!M) {
+        err.print("fu-balance-bench", errs());
+        _exit(1);
+      }
+      runBenchmark(file, move(M));
+    });
+  }
+
+  return ok ? 0 : 1;
+}
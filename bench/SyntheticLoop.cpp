@@ -0,0 +1,138 @@
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "InstructionMixAnalysis.h"
+#include "SyntheticLoop.h"
+
+#include <random>
+
+using namespace llvm;
+using namespace std;
+
+static bool parseMix(StringRef mix, vector<FuncUnit> &units, vector<unsigned> &weights) {
+  SmallVector<StringRef, FuncUnit::NumFuncUnits> pairs;
+  mix.split(pairs, ',', -1, false);
+
+  for (StringRef p : pairs) {
+    pair<StringRef, StringRef> kv = p.split(':');
+    unsigned weight;
+    if (kv.second.getAsInteger(10, weight))
+      return false;
+
+    int fu = 0;
+    while (fu < FuncUnit::NumFuncUnits && kv.first != FuncUnitNames[fu])
+      fu++;
+    switch (fu) {
+      case FuncUnit::FP32:
+      case FuncUnit::FP64:
+      case FuncUnit::IntAdd:
+      case FuncUnit::IntMul:
+      case FuncUnit::Shift:
+      case FuncUnit::Logic:
+      case FuncUnit::Conv32:
+      case FuncUnit::Conv64:
+      case FuncUnit::Mem:
+        units.push_back((FuncUnit) fu);
+        weights.push_back(weight);
+        break;
+      default:
+        errs() << "Unsupported unit in mix: " << kv.first << "\n";
+        return false;
+    }
+  }
+  return !units.empty();
+}
+
+bool llvm::buildSyntheticLoop(Module &M, StringRef name, unsigned size, StringRef mix, unsigned seed) {
+  vector<FuncUnit> units;
+  vector<unsigned> weights;
+  if (!parseMix(mix, units, weights))
+    return false;
+
+  mt19937 rng(seed);
+  discrete_distribution<unsigned> pick(weights.begin(), weights.end());
+
+  LLVMContext &ctx = M.getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+  Type *f32 = Type::getFloatTy(ctx);
+  Type *f64 = Type::getDoubleTy(ctx);
+  Type *params[] = {i32->getPointerTo(), f32->getPointerTo(), f64->getPointerTo(), i32};
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(ctx), params, false);
+  Function *F = Function::Create(FT, GlobalValue::ExternalLinkage, name, &M);
+
+  Function::arg_iterator args = F->arg_begin();
+  Value *ints = &*args++;
+  Value *floats = &*args++;
+  Value *doubles = &*args++;
+  Value *n = &*args++;
+
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *loop = BasicBlock::Create(ctx, "loop", F);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  IRBuilder<> B(entry);
+  B.CreateBr(loop);
+
+  B.SetInsertPoint(loop);
+  PHINode *iv = B.CreatePHI(i32, 2, "i");
+  iv->addIncoming(B.getInt32(0), entry);
+
+  vector<Value*> intPool = {B.CreateLoad(B.CreateGEP(ints, iv))};
+  vector<Value*> floatPool = {B.CreateLoad(B.CreateGEP(floats, iv))};
+  vector<Value*> doublePool = {B.CreateLoad(B.CreateGEP(doubles, iv))};
+
+  // Mostly consume recent values, to get realistic dependence chains
+  auto from = [&](vector<Value*> &pool) {
+    return pool[pool.size() - 1 - rng() % min<size_t>(pool.size(), 8)];
+  };
+
+  for (unsigned k = 0; k < size; k++) {
+    switch (units[pick(rng)]) {
+      case FuncUnit::FP32:
+        floatPool.push_back(B.CreateFAdd(from(floatPool), from(floatPool)));
+        break;
+      case FuncUnit::FP64:
+        doublePool.push_back(B.CreateFAdd(from(doublePool), from(doublePool)));
+        break;
+      case FuncUnit::IntAdd:
+        intPool.push_back(B.CreateAdd(from(intPool), from(intPool)));
+        break;
+      case FuncUnit::IntMul:
+        intPool.push_back(B.CreateMul(from(intPool), B.getInt32(2 << (rng() % 4))));
+        break;
+      case FuncUnit::Shift: {
+        static const Instruction::BinaryOps shifts[] = {Instruction::Shl, Instruction::LShr, Instruction::AShr};
+        Instruction::BinaryOps op = shifts[rng() % 3];
+        intPool.push_back(B.CreateBinOp(op, from(intPool), B.getInt32(1 + rng() % 4)));
+        break;
+      }
+      case FuncUnit::Logic:
+        intPool.push_back(B.CreateXor(from(intPool), from(intPool)));
+        break;
+      case FuncUnit::Conv32:
+        floatPool.push_back(B.CreateSIToFP(from(intPool), f32));
+        break;
+      case FuncUnit::Conv64:
+        doublePool.push_back(B.CreateSIToFP(from(intPool), f64));
+        break;
+      case FuncUnit::Mem:
+        intPool.push_back(B.CreateLoad(B.CreateGEP(ints, B.CreateAdd(iv, B.getInt32(k)))));
+        break;
+      default:
+        llvm_unreachable("Unit rejected by parseMix");
+    }
+  }
+
+  B.CreateStore(intPool.back(), B.CreateGEP(ints, iv));
+  B.CreateStore(floatPool.back(), B.CreateGEP(floats, iv));
+  B.CreateStore(doublePool.back(), B.CreateGEP(doubles, iv));
+
+  Value *next = B.CreateAdd(iv, B.getInt32(1), "i.next");
+  iv->addIncoming(next, loop);
+  B.CreateCondBr(B.CreateICmpSLT(next, n), loop, exit);
+
+  B.SetInsertPoint(exit);
+  B.CreateRetVoid();
+  return true;
+}
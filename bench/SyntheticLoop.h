@@ -0,0 +1,17 @@
+#ifndef SYNTHETIC_LOOP_H
+#define SYNTHETIC_LOOP_H
+
+#include "llvm/ADT/StringRef.h"
+
+namespace llvm {
+  class Module;
+
+  /**
+   * Adds a function called name holding a single-block innermost loop of
+   * roughly size instructions, drawn from mix ("Unit:weight,..."). Values
+   * are threaded through per-type pools so that nothing is trivially dead.
+   * Returns false if the mix cannot be parsed.
+   */
+  bool buildSyntheticLoop(Module &M, StringRef name, unsigned size, StringRef mix, unsigned seed);
+} // end namespace
+#endif
@@ -0,0 +1,39 @@
+
+from __future__ import print_function
+import sys
+import os
+import csv
+
+# Writes a -fu-balance-profile file for one program from its nvprof CSVs.
+# Shares are relative to that program's GPU time, so profile each
+# application separately:
+#   python ./profile.py rodinia/bfs/*.csv > bfs.profile
+
+def kernelName(data):
+  return data["Name"].split("(")[0].strip()
+
+# Each application's CSVs live in a directory of their own
+apps = set(os.path.dirname(os.path.abspath(path)) for path in sys.argv[1:])
+if len(apps) > 1:
+  sys.exit("error: CSVs from " + str(len(apps)) + " applications given; write one profile per application")
+
+durations = {}
+instructions = {}
+signatures = {}
+for path in sys.argv[1:]:
+  with open(path) as f:
+    for data in csv.DictReader(f, delimiter=',', quotechar="\""):
+      name = kernelName(data)
+      durations[name] = durations.get(name, 0) + float(data["Duration(ns)"])
+      instructions[name] = instructions.get(name, 0) + int(float(data["Instructions Executed"]))
+      signatures.setdefault(name, set()).add(data["Name"])
+
+# The pass matches kernels by unqualified name, so overloads share an entry
+for name in sorted(signatures):
+  if len(signatures[name]) > 1:
+    print("warning: " + str(len(signatures[name])) + " kernels named " + name + " are merged", file=sys.stderr)
+
+total = sum(durations.values())
+print("# kernel,runtime share,instructions executed")
+for name in sorted(durations, key=durations.get, reverse=True):
+  print(name + "," + str(durations[name]/total) + "," + str(instructions[name]))
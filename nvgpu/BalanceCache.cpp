@@ -0,0 +1,202 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "InstructionMixAnalysis.h"
+#include "Transformations.h"
+#include "BalanceCache.h"
+
+using namespace llvm;
+using namespace std;
+
+#define DEBUG_TYPE "fu-balance"
+
+// Bump whenever the hashed structure or the file format changes
+static const char *CacheVersion = "fu-balance-cache-v5";
+
+string BalanceCache::computeKey(Loop *L, BlockFrequencyInfo *BFI, DivergenceAnalysis *DA,
+                                vector<const Transformation*> const &transformations,
+                                float overuseRateThreshold) {
+  string buf;
+  raw_string_ostream os(buf);
+
+  os << CacheVersion << "\n";
+
+  // Machine model and pass options
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits - 1; fu++)
+    os << sm_35[fu] << " ";
+  os << "\n" << overuseRateThreshold << "\n";
+  for (const Transformation *tsfm : transformations)
+    os << tsfm->getName() << " ";
+  os << "\n";
+
+  // Permission to trade FP64 precision for FP32 throughput
+  Function *kernel = L->getHeader()->getParent();
+  os << kernel->getFnAttribute("unsafe-fp-math").getValueAsString() << "\n";
+
+  // Loop body. Operands defined inside the loop are named by position, so
+  // the key does not depend on value names or on the rest of the function.
+  DenseMap<Value*, unsigned> local;
+  unsigned index = 0;
+  for (Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block != blockEnd; ++block) {
+    local[*block] = index++;
+    for (Instruction &I : **block)
+      local[&I] = index++;
+  }
+
+  for (Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block != blockEnd; ++block) {
+    BasicBlock *B = *block;
+    os << "block " << BFI->getBlockFreq(B).getFrequency() << "\n";
+    for (Instruction &I : *B) {
+      os << I.getOpcodeName() << " " << *I.getType() << " " << I.getNumUses();
+      if (auto CMP = dyn_cast<CmpInst>(&I))
+        os << " p" << CMP->getPredicate();
+      if (isa<OverflowingBinaryOperator>(&I))
+        os << " w" << I.hasNoUnsignedWrap() << I.hasNoSignedWrap();
+      if (isa<FPMathOperator>(&I))
+        os << " f" << I.hasUnsafeAlgebra();
+      if (auto CI = dyn_cast<CallInst>(&I))
+        if (Function *F = CI->getCalledFunction())
+          os << " @" << F->getName();
+      if (InstructionMixAnalysis::isDivergentBranch(&I, DA))
+        os << " divergent";
+
+      for (Value *op : I.operands()) {
+        auto it = local.find(op);
+        if (it != local.end())
+          os << " %" << it->second;
+        else if (auto A = dyn_cast<Argument>(op))
+          os << " a" << A->getArgNo() << ":" << *A->getType();
+        else if (isa<Constant>(op) && !isa<GlobalValue>(op))
+          os << " " << *op;
+        else
+          os << " x:" << *op->getType();
+      }
+      os << "\n";
+    }
+  }
+  os.flush();
+
+  MD5 hash;
+  hash.update(buf);
+  MD5::MD5Result result;
+  hash.final(result);
+  SmallString<32> key;
+  MD5::stringifyResult(result, key);
+  return key.str();
+}
+
+Instruction *BalanceCache::instructionAt(Loop *L, unsigned index) {
+  for (Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block != blockEnd; ++block) {
+    for (Instruction &I : **block) {
+      if (index == 0)
+        return &I;
+      index--;
+    }
+  }
+  return nullptr;
+}
+
+unsigned BalanceCache::indexOf(Loop *L, Instruction *inst) {
+  unsigned index = 0;
+  for (Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block != blockEnd; ++block) {
+    for (Instruction &I : **block) {
+      if (&I == inst)
+        return index;
+      index++;
+    }
+  }
+  llvm_unreachable("Instruction is not in the loop");
+}
+
+string BalanceCache::pathFor(StringRef key) {
+  SmallString<128> path(dir);
+  sys::path::append(path, key);
+  return path.str();
+}
+
+static bool parseUsage(SmallVectorImpl<StringRef> &fields, array<unsigned long, FuncUnit::NumFuncUnits> &usage) {
+  if (fields.size() != FuncUnit::NumFuncUnits + 1)
+    return false;
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++)
+    if (fields[fu + 1].getAsInteger(10, usage[fu]))
+      return false;
+  return true;
+}
+
+bool BalanceCache::lookup(StringRef key, Entry &entry) {
+  ErrorOr<unique_ptr<MemoryBuffer> > buf = MemoryBuffer::getFile(pathFor(key));
+  if (!buf)
+    return false;
+
+  bool haveUsage = false, haveResult = false;
+  entry.steps.clear();
+
+  SmallVector<StringRef, 32> lines;
+  (*buf)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    SmallVector<StringRef, FuncUnit::NumFuncUnits + 1> fields;
+    line.split(fields, ' ', -1, false);
+    StringRef kind = fields.empty() ? "" : fields[0];
+
+    if (kind == "mix") {
+      haveUsage = parseUsage(fields, entry.usage);
+    } else if (kind == "result") {
+      haveResult = parseUsage(fields, entry.result);
+    } else if (kind == "step" && fields.size() == 3) {
+      unsigned tsfm, inst;
+      if (fields[1].getAsInteger(10, tsfm) || fields[2].getAsInteger(10, inst))
+        return false;
+      entry.steps.push_back(make_pair(tsfm, inst));
+    } else {
+      DEBUG(errs() << "Malformed cache entry " << key << "\n");
+      return false;
+    }
+  }
+
+  return haveUsage && haveResult;
+}
+
+void BalanceCache::store(StringRef key, Entry const &entry) {
+  if (sys::fs::create_directories(dir))
+    return;
+
+  // Write to a unique file first so that concurrent builds never observe a
+  // partially written entry
+  int fd;
+  SmallString<128> tmpPath;
+  if (sys::fs::createUniqueFile(pathFor(key) + "-%%%%%%.tmp", fd, tmpPath))
+    return;
+
+  {
+    raw_fd_ostream os(fd, true);
+    os << "mix";
+    for (unsigned long u : entry.usage)
+      os << " " << u;
+    os << "\nresult";
+    for (unsigned long u : entry.result)
+      os << " " << u;
+    os << "\n";
+    for (auto step : entry.steps)
+      os << "step " << step.first << " " << step.second << "\n";
+
+    // The cache is optional, so a full disk must not abort the compile
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+
+  if (sys::fs::rename(tmpPath, pathFor(key)))
+    sys::fs::remove(tmpPath);
+}
@@ -0,0 +1,48 @@
+#ifndef BALANCE_CACHE_H
+#define BALANCE_CACHE_H
+
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <utility>
+
+using namespace std;
+
+namespace llvm {
+  /**
+   * On-disk cache of balancing decisions, one file per loop. Entries are
+   * content-addressed by a structural hash of the loop body, the machine
+   * model and the transformation set, so unchanged loops in a rebuild can
+   * replay the previous decisions instead of searching again.
+   */
+  class BalanceCache {
+    public:
+      struct Entry {
+        array<unsigned long, FuncUnit::NumFuncUnits> usage;  // Mix before balancing
+        array<unsigned long, FuncUnit::NumFuncUnits> result; // Mix after balancing
+        vector<pair<unsigned, unsigned> > steps; // (transformation, instruction) indices
+      };
+
+      BalanceCache(StringRef dir) : dir(dir) {}
+
+      bool lookup(StringRef key, Entry &entry);
+      void store(StringRef key, Entry const &entry);
+
+      /**
+       * Hashes everything the balancing decisions of L depend on. Value
+       * names are ignored, instructions are identified by their position.
+       */
+      static string computeKey(Loop *L, BlockFrequencyInfo *BFI, DivergenceAnalysis *DA,
+                               vector<const Transformation*> const &transformations,
+                               float overuseRateThreshold);
+
+      // Instructions are numbered in loop block order
+      static Instruction *instructionAt(Loop *L, unsigned index);
+      static unsigned indexOf(Loop *L, Instruction *I);
+    private:
+      string dir;
+
+      string pathFor(StringRef key);
+  };
+} // end namespace
+#endif
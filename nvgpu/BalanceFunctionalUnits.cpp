@@ -1,6 +1,9 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -14,92 +17,350 @@
 
 #include "InstructionMixAnalysis.h"
 #include "Transformations.h"
+#include "BalanceCache.h"
+#include "BalanceProfile.h"
 #include "BalanceFunctionalUnits.h"
 
+#include <algorithm>
+
 using namespace llvm;
 using namespace std;
 
 #define DEBUG_TYPE "fu-balance"
 
-bool BalanceFunctionalUnits::runOnLoop(Loop *L, LPPassManager &LPM) {
-  if(L->getSubLoops().size() > 0)
-    return false; // Abort, not an innermost loop
+static cl::opt<string> CacheDir("fu-balance-cache-dir",
+                                cl::desc("Directory used to cache balancing decisions across builds"),
+                                cl::init(""));
+
+static cl::opt<string> ProfileFile("fu-balance-profile",
+                                   cl::desc("Per-kernel runtime profile, as written by data/profile.py"),
+                                   cl::init(""));
+
+static cl::opt<double> HotThreshold("fu-balance-hot-threshold",
+                                    cl::desc("Minimum runtime share of a profiled kernel for it to be balanced"),
+                                    cl::init(0.01));
+
+static cl::opt<unsigned long long> FunctionBudget("fu-balance-function-budget",
+                                                  cl::desc("Instructions the balancer may examine per function (0 for no limit)"),
+                                                  cl::init(0));
+
+static cl::opt<unsigned long long> ModuleBudget("fu-balance-module-budget",
+                                                cl::desc("Instructions the balancer may examine per module (0 for no limit). "
+                                                         "Profiled kernels get at most their runtime share of it."),
+                                                cl::init(0));
+
+static cl::opt<unsigned> TimeBudget("fu-balance-time-budget",
+                                    cl::desc("Milliseconds the balancer may spend per module (0 for no limit)"),
+                                    cl::init(0));
+
+static void collectInnermostLoops(Loop *L, vector<Loop*> &loops) {
+  if (L->getSubLoops().empty()) {
+    loops.push_back(L);
+    return;
+  }
+  for (Loop *subLoop : L->getSubLoops())
+    collectInnermostLoops(subLoop, loops);
+}
+
+bool BalanceFunctionalUnits::doInitialization(Module &M) {
+  numIterations = 0;
+  module = Budget();
+  module.limit = ModuleBudget;
+  moduleStarted = false;
 
-  array<unsigned long, FuncUnit::NumFuncUnits> usage = getAnalysis<InstructionMixAnalysis>().getUsage();
-  BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  profile = BalanceProfile();
+  if (!ProfileFile.empty() && !profile.load(ProfileFile))
+    errs() << "warning: could not read balancing profile " << ProfileFile << "\n";
+
+  return false;
+}
+
+bool BalanceFunctionalUnits::runOnFunction(Function &F) {
+  // Every pass is initialized before the pipeline runs, so the clock starts
+  // here rather than in doInitialization
+  if (!moduleStarted) {
+    moduleStart = chrono::steady_clock::now();
+    moduleStarted = true;
+  }
+
+  if (!isHot(F))
+    return false;
+
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  BlockFrequencyInfo *BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  DivergenceAnalysis *DA = &getAnalysis<DivergenceAnalysis>();
+  PostDominatorTree *PDT = &getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
+
+  vector<Loop*> loops;
+  for (Loop *L : LI)
+    collectInnermostLoops(L, loops);
+
+  Budget function;
+  function.limit = functionBudget(F);
   bool changed = false;
 
+  for (Loop *L : loops) {
+    LoopState S = {L, BFI, DA, PDT, function};
+    changed |= balanceLoop(S);
+  }
+
+  return changed;
+}
+
+bool BalanceFunctionalUnits::balanceLoop(LoopState &S) {
+  Loop *L = S.L;
+
+  if (outOfBudget(S)) {
+    emitRemark(L, "BudgetExhausted", "balancing skipped, budget exhausted");
+    return false;
+  }
+
+  vector<const Transformation*> const &transformations = Transformation::getRegistry();
+  array<unsigned long, FuncUnit::NumFuncUnits> usage = InstructionMixAnalysis::computeUsage(L, S.BFI, S.DA, S.PDT);
+  set<Candidate> rejected;
+  bool changed = false;
+  bool exhausted = false;
+  double initialOveruse = overuseRate(usage);
+  unsigned long loopSize = 0;
+  for (Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block != blockEnd; ++block)
+    loopSize += (*block)->size();
+
+  string cacheKey;
+  BalanceCache::Entry entry;
+  if (!CacheDir.empty()) {
+    cacheKey = BalanceCache::computeKey(L, S.BFI, S.DA, transformations, overuseRateThreshold);
+    // Values defined outside the loop are hashed by type only, but some
+    // transformations look at them, so the same key may start from a
+    // different mix
+    if (BalanceCache(CacheDir).lookup(cacheKey, entry) && entry.usage == usage &&
+        replayDecisions(S, entry)) {
+      DEBUG(errs() << "Replayed " << entry.steps.size() << " cached decisions\n");
+      return !entry.steps.empty();
+    }
+    entry.usage = usage;
+    entry.steps.clear();
+  }
+
   while (true) {
-    pair<Transformation*, Instruction*> next = selectNextTransformation(L, usage);
-    Transformation *tsfm = get<0>(next);
+    // Every committed step improves the loop, so stopping here keeps the
+    // best solution found so far
+    if (outOfBudget(S)) {
+      exhausted = true;
+      break;
+    }
+
+    bool truncated = false;
+    Candidate next = selectNextTransformation(S, usage, rejected, truncated);
+    numIterations++;
+    const Transformation *tsfm = get<0>(next);
     Instruction *inst = get<1>(next);
     if (tsfm == nullptr) {
+      // Only a complete scan proves that no candidate is left
+      exhausted = truncated;
       break;
     }
-    tsfm->applyTransformation(inst);
-    usage = transformationEffect(tsfm, inst, usage);
-    changed = true;
+
+    // The usageChange estimate cannot see fusion or cast elimination, so
+    // apply the rewrite tentatively and measure the loop it leaves behind
+    unsigned instIndex = cacheKey.empty() ? 0 : BalanceCache::indexOf(L, inst);
+    TransformationJournal journal;
+    tsfm->applyTransformation(inst, journal);
+    array<unsigned long, FuncUnit::NumFuncUnits> transformedUsage = InstructionMixAnalysis::computeUsage(L, S.BFI, S.DA, S.PDT);
+    spend(S, loopSize);
+
+    if (overuseRate(transformedUsage) < overuseRate(usage)) {
+      journal.commit();
+      usage = transformedUsage;
+      rejected.clear();
+      changed = true;
+
+      unsigned tsfmIndex = find(transformations.begin(), transformations.end(), tsfm) - transformations.begin();
+      entry.steps.push_back(make_pair(tsfmIndex, instIndex));
+    } else {
+      DEBUG(errs() << "Rolling back transformation of "; inst->dump());
+      journal.rollback();
+      rejected.insert(next);
+    }
   }
 
-  return changed;;
+  // A partial search must not be replayed once more budget is available
+  if (!cacheKey.empty() && !exhausted) {
+    entry.result = usage;
+    BalanceCache(CacheDir).store(cacheKey, entry);
+  }
+
+  if (exhausted || changed) {
+    double finalOveruse = overuseRate(usage);
+    string msg;
+    raw_string_ostream os(msg);
+    if (exhausted)
+      os << "balancing budget exhausted; ";
+    os << "overuse rate reduced from " << initialOveruse << " to " << finalOveruse;
+    if (exhausted && initialOveruse > 0)
+      os << " (" << (int) (100 * (initialOveruse - finalOveruse) / initialOveruse)
+         << "% lower) before the search stopped; a larger budget may reduce it further";
+    emitRemark(L, exhausted ? "BudgetExhausted" : "Balanced", os.str());
+  }
+
+  return changed;
+}
+
+unsigned long BalanceFunctionalUnits::functionBudget(Function &F) {
+  unsigned long limit = FunctionBudget;
+
+  // Hot kernels may use their share of the module budget
+  BalanceProfile::Kernel const *kernel = profile.lookup(F);
+  if (ModuleBudget && kernel) {
+    // A limit of 0 would mean no limit at all
+    unsigned long share = max(1UL, (unsigned long) (ModuleBudget * kernel->runtimeShare));
+    limit = limit ? min(limit, share) : share;
+  }
+  return limit;
+}
+
+void BalanceFunctionalUnits::spend(LoopState &S, unsigned long work) {
+  S.function.work += work;
+  module.work += work;
+}
+
+bool BalanceFunctionalUnits::outOfBudget(LoopState &S) {
+  if (S.function.limit && S.function.work >= S.function.limit)
+    return true;
+  if (module.limit && module.work >= module.limit)
+    return true;
+  if (TimeBudget && chrono::steady_clock::now() - moduleStart >= chrono::milliseconds(TimeBudget))
+    return true;
+  return false;
+}
+
+void BalanceFunctionalUnits::emitRemark(Loop *L, StringRef name, StringRef msg) {
+  OptimizationRemarkAnalysis R(DEBUG_TYPE, name, L->getStartLoc(), L->getHeader());
+  R << msg;
+  L->getHeader()->getContext().diagnose(R);
+}
+
+bool BalanceFunctionalUnits::isHot(Function &F) {
+  // Kernels missing from the profile were not measured, not found cold
+  BalanceProfile::Kernel const *kernel = profile.lookup(F);
+  if (!kernel)
+    return true;
+
+  DEBUG(errs() << F.getName() << ": " << kernel->runtimeShare << " of runtime, "
+               << kernel->instructions << " instructions\n");
+  return kernel->runtimeShare >= HotThreshold;
+}
+
+bool BalanceFunctionalUnits::replayDecisions(LoopState &S, BalanceCache::Entry const &entry) {
+  vector<const Transformation*> const &transformations = Transformation::getRegistry();
+  TransformationJournal journal;
+
+  for (auto step : entry.steps) {
+    Instruction *inst = BalanceCache::instructionAt(S.L, step.second);
+    if (step.first >= transformations.size() || !inst ||
+        !transformations[step.first]->canTransform(inst)) {
+      journal.rollback();
+      return false;
+    }
+    transformations[step.first]->applyTransformation(inst, journal);
+  }
+
+  // A hash collision would show up as a different final mix
+  if (InstructionMixAnalysis::computeUsage(S.L, S.BFI, S.DA, S.PDT) != entry.result) {
+    journal.rollback();
+    return false;
+  }
+
+  journal.commit();
+  return true;
 }
 
 void BalanceFunctionalUnits::getAnalysisUsage(AnalysisUsage &AU) const {
-  AU.addRequired<InstructionMixAnalysis>();
+  AU.addRequired<LoopInfoWrapperPass>();
   AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  AU.addRequired<DivergenceAnalysis>();
+  AU.addRequired<PostDominatorTreeWrapperPass>();
   AU.setPreservesCFG();
 }
 
-pair<Transformation*, Instruction*> BalanceFunctionalUnits::selectNextTransformation(Loop *L, array<unsigned long, FuncUnit::NumFuncUnits> usage) {
-  vector<pair<Transformation*, Instruction*> > candidates;
-  Transformation *bestTransformation = nullptr;
-  Instruction *bestInstruction = nullptr;
-  float minOveruseRate = fmin(overuseRateThreshold, overuseRate(usage));
+BalanceFunctionalUnits::Candidate BalanceFunctionalUnits::selectNextTransformation(LoopState &S, array<unsigned long, FuncUnit::NumFuncUnits> usage, set<Candidate> const &rejected, bool &truncated) {
+  vector<const Transformation*> const &transformations = Transformation::getRegistry();
+  vector<Candidate> candidates;
+  CandidateMatrix effects;
 
-  for (vector<Transformation*>::iterator tsfm = transformations.begin(); tsfm != transformations.end(); tsfm++) {
-    for(Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block!= blockEnd; ++block) {
+  // Walking the IR only gathers candidates, scoring happens in one batch
+  for (vector<const Transformation*>::const_iterator tsfm = transformations.begin(); tsfm != transformations.end(); tsfm++) {
+    for(Loop::block_iterator block = S.L->block_begin(), blockEnd = S.L->block_end(); block!= blockEnd; ++block) {
       BasicBlock *B = *block;
+      // Anytime: settle for the best candidate seen before the budget ran out
+      if (outOfBudget(S)) {
+        truncated = true;
+        break;
+      }
+      spend(S, B->size());
+      double freq = S.BFI->getBlockFreq(B).getFrequency();
       for(BasicBlock::iterator I = B->begin(), E = B->end(); I !=E; I++) {
-        if ((*tsfm)->canTransform(&*I)) {
-          array<unsigned long, FuncUnit::NumFuncUnits> transformedUsage = transformationEffect(*tsfm, &*I, usage);
-          float overuse = overuseRate(transformedUsage);
-          if (overuse < minOveruseRate) {
-            minOveruseRate = overuse;
-            bestTransformation = *tsfm;
-            bestInstruction = &*I;
-          }
+        if ((*tsfm)->canTransform(&*I) && !rejected.count(make_pair(*tsfm, &*I))) {
+          effects.append((*tsfm)->usageChange, freq);
           candidates.push_back(make_pair(*tsfm, &*I));
         }
       }
     }
   }
 
-  return make_pair(bestTransformation, bestInstruction);
-}
+  vector<double> scores;
+  scoreCandidates(usage, effects, scores);
 
-array<unsigned long, FuncUnit::NumFuncUnits> BalanceFunctionalUnits::transformationEffect(Transformation *tsfm, Instruction *I, array<unsigned long, FuncUnit::NumFuncUnits> usage) {
-  array<unsigned long, FuncUnit::NumFuncUnits> transformedUsage;
-  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++) {
-    transformedUsage[fu] = usage[fu] + tsfm->usageChange[fu] * BFI->getBlockFreq(I->getParent()).getFrequency();
+  Candidate best(nullptr, nullptr);
+  double minOveruseRate = fmin(overuseRateThreshold, overuseRate(usage));
+  for (size_t c = 0; c < candidates.size(); c++) {
+    if (scores[c] < minOveruseRate) {
+      minOveruseRate = scores[c];
+      best = candidates[c];
+    }
   }
-  return transformedUsage;
+
+  return best;
 }
 
-float BalanceFunctionalUnits::overuseRate(array<unsigned long, FuncUnit::NumFuncUnits> usage) {
-  float usageTotal = 0;
-  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++) {
+void BalanceFunctionalUnits::CandidateMatrix::append(array<int, FuncUnit::NumFuncUnits> const &usageChange, double freq) {
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++)
+    deltas[fu].push_back(usageChange[fu] * freq);
+}
+
+void BalanceFunctionalUnits::scoreCandidates(array<unsigned long, FuncUnit::NumFuncUnits> const &usage, CandidateMatrix const &effects, vector<double> &scores) {
+  size_t n = effects.size();
+  scores.assign(n, 0.0);
+
+  // Each pass below streams one column of the matrix, and the candidates
+  // are independent, so the inner loops vectorize
+  double usageTotal = 0;
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++)
     usageTotal += usage[fu];
+
+  vector<double> total(n, usageTotal);
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++) {
+    const double *delta = effects.deltas[fu].data();
+    for (size_t c = 0; c < n; c++)
+      total[c] += delta[c];
   }
+  for (size_t c = 0; c < n; c++)
+    total[c] = 1.0 / total[c];
 
-  float overuse = 0;
   // The -1 is because Pseudo instructions have no functional units
   for (int fu = 0; fu < FuncUnit::NumFuncUnits - 1; fu++) {
-    if (usage[fu]/usageTotal > sm_35[fu]/256) {
-      overuse += (usage[fu]/usageTotal) / (sm_35[fu]/256.0);
+    const double *delta = effects.deltas[fu].data();
+    const double base = usage[fu];
+    const double ideal = sm_35[fu] / 256.0;
+    const double invIdeal = 256.0 / sm_35[fu];
+    for (size_t c = 0; c < n; c++) {
+      double share = (base + delta[c]) * total[c];
+      scores[c] += share > ideal ? share * invIdeal : 0.0;
     }
   }
+}
 
-  return overuse;
+double BalanceFunctionalUnits::overuseRate(array<unsigned long, FuncUnit::NumFuncUnits> usage) {
+  return InstructionMixAnalysis::getOveruseRate(usage);
 }
 
 char BalanceFunctionalUnits::ID = 0;
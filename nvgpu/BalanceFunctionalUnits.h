@@ -2,27 +2,89 @@
 #define BALANCE_FUNCTIONAL_UNITS_H
 
 #include <cfloat>
+#include <chrono>
+#include <set>
 
 using namespace std;
 
 namespace llvm {
 
-  class BalanceFunctionalUnits : public LoopPass {
+  /**
+   * Balances the innermost loops of each function. Per-function and
+   * per-loop state lives in local objects, and the transformation registry
+   * is shared and immutable, so pipelines on different threads can each run
+   * their own instance concurrently.
+   */
+  class BalanceFunctionalUnits : public FunctionPass {
     public:
       static char ID;
 
-      BalanceFunctionalUnits() : LoopPass(ID) {}
+      BalanceFunctionalUnits() : FunctionPass(ID) {}
 
       void getAnalysisUsage(AnalysisUsage &AU) const override;
-      bool runOnLoop(Loop *L, LPPassManager &LPM) override;
+      bool doInitialization(Module &M) override;
+      bool runOnFunction(Function &F) override;
+
+      /**
+       * Number of candidate selections made so far, including ones that
+       * were rolled back
+       */
+      unsigned long getNumIterations() const { return numIterations; }
     private:
-      float overuseRateThreshold = FLT_MAX;
-      BlockFrequencyInfo *BFI;
+      typedef pair<const Transformation*, Instruction*> Candidate;
+
+      // Work is counted in instructions examined
+      struct Budget {
+        unsigned long work = 0;
+        unsigned long limit = 0; // 0 for no limit
+      };
+
+      // Everything the balancer knows about the loop it is working on
+      struct LoopState {
+        Loop *L;
+        BlockFrequencyInfo *BFI;
+        DivergenceAnalysis *DA;
+        PostDominatorTree *PDT;
+        Budget &function;
+      };
+
+      /**
+       * Usage deltas of the candidate transformations, stored column by
+       * column: deltas[fu][c] is the change in unit fu if candidate c is
+       * applied.
+       */
+      struct CandidateMatrix {
+        vector<double> deltas[FuncUnit::NumFuncUnits];
+
+        size_t size() const { return deltas[0].size(); }
+        void append(array<int, FuncUnit::NumFuncUnits> const &usageChange, double freq);
+      };
+
+      const float overuseRateThreshold = FLT_MAX;
+
+      // Module-wide state, reset by doInitialization
+      unsigned long numIterations = 0;
+      Budget module;
+      bool moduleStarted = false;
+      chrono::steady_clock::time_point moduleStart;
+      BalanceProfile profile;
+
+      bool balanceLoop(LoopState &S);
+      bool isHot(Function &F);
+      unsigned long functionBudget(Function &F);
+      void spend(LoopState &S, unsigned long work);
+      bool outOfBudget(LoopState &S);
+      void emitRemark(Loop *L, StringRef name, StringRef msg);
 
-      pair<Transformation*, Instruction*> selectNextTransformation(Loop *L, array<unsigned long, FuncUnit::NumFuncUnits> usage);
-      array<unsigned long, FuncUnit::NumFuncUnits> transformationEffect(Transformation *tsfm, Instruction *I, array<unsigned long, FuncUnit::NumFuncUnits> usage);
-      float overuseRate(array<unsigned long, FuncUnit::NumFuncUnits> usage);
-      vector<Transformation*> transformations = {new ShlToMul, new ShrToDiv, new MulToShl, new Cvt32ToCvt64};
+      bool replayDecisions(LoopState &S, BalanceCache::Entry const &entry);
+      /**
+       * Returns the candidate that lowers the overuse rate the most, or
+       * nullptr if there is none. Sets truncated if the budget ran out
+       * before every candidate was seen.
+       */
+      Candidate selectNextTransformation(LoopState &S, array<unsigned long, FuncUnit::NumFuncUnits> usage, set<Candidate> const &rejected, bool &truncated);
+      static void scoreCandidates(array<unsigned long, FuncUnit::NumFuncUnits> const &usage, CandidateMatrix const &effects, vector<double> &scores);
+      static double overuseRate(array<unsigned long, FuncUnit::NumFuncUnits> usage);
   };
 
 } // end namespace
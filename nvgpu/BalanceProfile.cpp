@@ -0,0 +1,54 @@
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "BalanceProfile.h"
+
+using namespace llvm;
+using namespace std;
+
+bool BalanceProfile::load(StringRef path) {
+  ErrorOr<unique_ptr<MemoryBuffer> > buf = MemoryBuffer::getFile(path);
+  if (!buf)
+    return false;
+
+  SmallVector<StringRef, 32> lines;
+  (*buf)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    line = line.trim();
+    if (line.empty() || line.startswith("#"))
+      continue;
+
+    SmallVector<StringRef, 3> fields;
+    line.split(fields, ',');
+    Kernel kernel;
+    if (fields.size() != 3 ||
+        fields[1].trim().getAsDouble(kernel.runtimeShare) ||
+        fields[2].trim().getAsInteger(10, kernel.instructions)) {
+      // Filtering with part of a profile would skip kernels arbitrarily
+      kernels.clear();
+      return false;
+    }
+    kernels[fields[0].trim()] = kernel;
+  }
+  return true;
+}
+
+BalanceProfile::Kernel const *BalanceProfile::lookup(Function const &F) const {
+  StringRef name = F.getName();
+  auto it = kernels.find(name);
+  if (it != kernels.end())
+    return &it->second;
+
+  // _Z<length><identifier><parameters>
+  if (!name.startswith("_Z"))
+    return nullptr;
+  name = name.drop_front(2);
+  size_t digits = name.find_first_not_of("0123456789");
+  unsigned length;
+  if (digits == 0 || digits == StringRef::npos || name.substr(0, digits).getAsInteger(10, length))
+    return nullptr;
+
+  it = kernels.find(name.substr(digits, length));
+  return it != kernels.end() ? &it->second : nullptr;
+}
@@ -0,0 +1,34 @@
+#ifndef BALANCE_PROFILE_H
+#define BALANCE_PROFILE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+using namespace std;
+
+namespace llvm {
+  /**
+   * Measured per-kernel runtime share and dynamic instruction count, read
+   * from "kernel,share,instructions" lines as written by data/profile.py.
+   */
+  class BalanceProfile {
+    public:
+      struct Kernel {
+        double runtimeShare; // Fraction of the program's profiled GPU time
+        unsigned long instructions;
+      };
+
+      // Leaves the profile empty if the file cannot be read completely
+      bool load(StringRef path);
+      bool empty() const { return kernels.empty(); }
+
+      /**
+       * Finds the profile of F by name. Mangled names are matched on their
+       * unqualified identifier, as nvprof reports kernels that way.
+       */
+      Kernel const *lookup(Function const &F) const;
+    private:
+      StringMap<Kernel> kernels;
+  };
+} // end namespace
+#endif
@@ -0,0 +1,124 @@
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "InstructionMixAnalysis.h"
+#include "FUInstrumentation.h"
+
+using namespace llvm;
+using namespace std;
+
+#define DEBUG_TYPE "fu-instrument"
+
+bool FUInstrumentation::runOnModule(Module &M) {
+  // Loops are freed once LoopInfo runs on the next function, so only their
+  // blocks are kept
+  vector<vector<BasicBlock*> > loops;
+  vector<string> loopNames;
+
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    vector<Loop*> innermost;
+    for (Loop *L : LI)
+      collectInnermostLoops(L, innermost);
+
+    for (unsigned i = 0; i < innermost.size(); i++) {
+      loops.push_back(vector<BasicBlock*>(innermost[i]->block_begin(), innermost[i]->block_end()));
+      loopNames.push_back((F.getName() + ":" + Twine(i)).str());
+    }
+  }
+
+  if (loops.empty())
+    return false;
+
+  // One row of counters per loop, one column per functional unit
+  LLVMContext &ctx = M.getContext();
+  Type *rowTy = ArrayType::get(Type::getInt64Ty(ctx), FuncUnit::NumFuncUnits);
+  Type *tableTy = ArrayType::get(rowTy, loops.size());
+  GlobalVariable *counters = new GlobalVariable(M, tableTy, false, GlobalValue::InternalLinkage,
+                                                Constant::getNullValue(tableTy), "__fu_mix_counters");
+
+  for (unsigned i = 0; i < loops.size(); i++) {
+    for (BasicBlock *block : loops[i]) {
+      instrumentBlock(block, counters, i);
+    }
+  }
+
+  appendToGlobalDtors(M, createDumpFunction(M, counters, loopNames), 0);
+  return true;
+}
+
+void FUInstrumentation::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<LoopInfoWrapperPass>();
+}
+
+void FUInstrumentation::collectInnermostLoops(Loop *L, vector<Loop*> &loops) {
+  if (L->getSubLoops().empty()) {
+    loops.push_back(L);
+    return;
+  }
+  for (Loop *subLoop : L->getSubLoops())
+    collectInnermostLoops(subLoop, loops);
+}
+
+void FUInstrumentation::instrumentBlock(BasicBlock *BB, Value *counters, unsigned loopIndex) {
+  // Classify the block before any counter code is added to it
+  array<unsigned long, FuncUnit::NumFuncUnits> blockUsage;
+  blockUsage.fill(0);
+  for (Instruction &I : *BB) {
+    for (FuncUnit fu : InstructionMixAnalysis::unitForInst(&I))
+      blockUsage[fu]++;
+  }
+
+  IRBuilder<> builder(&*BB->getFirstInsertionPt());
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits - 1; fu++) {
+    if (blockUsage[fu] == 0)
+      continue;
+    Value *idx[] = {builder.getInt32(0), builder.getInt32(loopIndex), builder.getInt32(fu)};
+    Value *counter = builder.CreateInBoundsGEP(counters, idx);
+    Value *count = builder.CreateLoad(counter);
+    builder.CreateStore(builder.CreateAdd(count, builder.getInt64(blockUsage[fu])), counter);
+  }
+}
+
+Function *FUInstrumentation::createDumpFunction(Module &M, GlobalVariable *counters, vector<string> const &loopNames) {
+  LLVMContext &ctx = M.getContext();
+  Type *i8PtrTy = Type::getInt8PtrTy(ctx);
+  Constant *printfFn = M.getOrInsertFunction("printf", FunctionType::get(Type::getInt32Ty(ctx), i8PtrTy, true));
+
+  Function *dump = Function::Create(FunctionType::get(Type::getVoidTy(ctx), false),
+                                    GlobalValue::InternalLinkage, "__fu_mix_dump", &M);
+  IRBuilder<> builder(BasicBlock::Create(ctx, "entry", dump));
+
+  Value *format = builder.CreateGlobalStringPtr("fu-mix %s %s %lu %d\n");
+  vector<Value*> unitNames;
+  for (int fu = 0; fu < FuncUnit::NumFuncUnits; fu++)
+    unitNames.push_back(builder.CreateGlobalStringPtr(FuncUnitNames[fu]));
+
+  for (unsigned i = 0; i < loopNames.size(); i++) {
+    Value *loopName = builder.CreateGlobalStringPtr(loopNames[i]);
+    // Pseudo instructions occupy no unit and are not reported
+    for (int fu = 0; fu < FuncUnit::NumFuncUnits - 1; fu++) {
+      Value *idx[] = {builder.getInt32(0), builder.getInt32(i), builder.getInt32(fu)};
+      Value *count = builder.CreateLoad(builder.CreateInBoundsGEP(counters, idx));
+      Value *args[] = {format, loopName, unitNames[fu],
+                       count, builder.getInt32(sm_35[fu])};
+      builder.CreateCall(printfFn, args);
+    }
+  }
+
+  builder.CreateRetVoid();
+  return dump;
+}
+
+char FUInstrumentation::ID = 0;
+static RegisterPass<FUInstrumentation> X("fu-instrument", "Count dynamic functional unit usage of innermost loops",
+                                        false,
+                                        false);
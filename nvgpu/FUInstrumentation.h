@@ -0,0 +1,28 @@
+#ifndef FU_INSTRUMENTATION_H
+#define FU_INSTRUMENTATION_H
+
+using namespace std;
+
+namespace llvm {
+  /**
+   * Inserts a counter per functional unit into every innermost loop and
+   * prints the dynamic mix at exit, one "fu-mix <loop> <unit> <count>
+   * <throughput>" line per unit. Loops are named <function>:<index> in loop
+   * nest preorder, which balancing does not change since it preserves the
+   * CFG.
+   */
+  class FUInstrumentation : public ModulePass {
+    public:
+      static char ID;
+
+      FUInstrumentation() : ModulePass(ID) {}
+
+      void getAnalysisUsage(AnalysisUsage &AU) const override;
+      bool runOnModule(Module &M) override;
+    private:
+      void collectInnermostLoops(Loop *L, vector<Loop*> &loops);
+      void instrumentBlock(BasicBlock *BB, Value *counters, unsigned loopIndex);
+      Function *createDumpFunction(Module &M, GlobalVariable *counters, vector<string> const &loopNames);
+  };
+} // end namespace
+#endif
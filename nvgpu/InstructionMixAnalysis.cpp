@@ -1,9 +1,11 @@
 #include "llvm/IR/PassManager.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -57,30 +59,88 @@ bool InstructionMixAnalysis::runOnLoop(Loop *L, LPPassManager &LPM) {
   if(L->getSubLoops().size() > 0)
     return false; // Abort, not an innermost loop
 
+  DivergenceAnalysis *DA = &getAnalysis<DivergenceAnalysis>();
+  array<unsigned long, FuncUnit::NumFuncUnits> usage = computeUsage(L, nullptr, DA, nullptr);
+
+  DEBUG(for (BasicBlock *B : L->blocks())
+          for (Instruction &I : *B)
+            if (DA->isDivergent(&I)) {
+              errs() << "Divergent "; I.dump();
+            });
+
+  for (int i = 0; i < FuncUnit::NumFuncUnits; i++) {
+    DEBUG(errs() << FuncUnitNames[i] << " " << usage[i] << "\n");
+  }
+  DEBUG(errs() << "\n");
+
+  return false;
+}
+
+array<unsigned long, FuncUnit::NumFuncUnits> InstructionMixAnalysis::computeUsage(Loop *L, BlockFrequencyInfo *BFI, DivergenceAnalysis *DA,
+                                                                         PostDominatorTree *PDT) {
+  array<unsigned long, FuncUnit::NumFuncUnits> loopUsage;
+
   // Zero-initialize usage
   for(int i = 0; i < FuncUnit::NumFuncUnits; i++) {
-    usage[i] = 0;
+    loopUsage[i] = 0;
   }
 
+  // Lanes that skip a divergent region still wait for it to issue
+  DenseMap<BasicBlock*, uint64_t> regionWeights;
+  if (BFI && PDT)
+    weighDivergentRegions(L, BFI, DA, PDT, regionWeights);
+
   for(Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block!= blockEnd; ++block) {
     BasicBlock *B = *block;
+    unsigned long weight = BFI ? BFI->getBlockFreq(B).getFrequency() : 1;
+    auto region = regionWeights.find(B);
+    if (region != regionWeights.end())
+      weight = max<unsigned long>(weight, region->second);
+
     for(BasicBlock::iterator I = B->begin(), E = B->end(); I !=E; I++) {
       vector<FuncUnit> freq = unitForInst(&*I);
       for (FuncUnit fu : freq) {
-        usage[fu]++;
+        loopUsage[fu] += weight;
       }
-	  }
+      if (isDivergentBranch(&*I, DA))
+        loopUsage[FuncUnit::Control] += weight; // Reconvergence
+    }
   }
 
-  for (int i = 0; i < FuncUnit::NumFuncUnits; i++) {
-    DEBUG(errs() << FuncUnitNames[i] << " " << usage[i] << "\n");
+  return loopUsage;
+}
+
+void InstructionMixAnalysis::weighDivergentRegions(Loop *L, BlockFrequencyInfo *BFI, DivergenceAnalysis *DA,
+                                                   PostDominatorTree *PDT, DenseMap<BasicBlock*, uint64_t> &weights) {
+  for (Loop::block_iterator block = L->block_begin(), blockEnd = L->block_end(); block != blockEnd; ++block) {
+    BasicBlock *branch = *block;
+    if (!isDivergentBranch(branch->getTerminator(), DA))
+      continue;
+
+    // The region ends where the lanes reconverge, or at the next iteration
+    uint64_t freq = BFI->getBlockFreq(branch).getFrequency();
+    DomTreeNode *node = PDT->getNode(branch);
+    BasicBlock *reconverge = node && node->getIDom() ? node->getIDom()->getBlock() : nullptr;
+
+    SmallPtrSet<BasicBlock*, 16> visited;
+    SmallVector<BasicBlock*, 16> worklist(succ_begin(branch), succ_end(branch));
+    while (!worklist.empty()) {
+      BasicBlock *B = worklist.pop_back_val();
+      if (B == reconverge || B == L->getHeader() || !L->contains(B) || !visited.insert(B).second)
+        continue;
+      weights[B] = max(weights.lookup(B), freq);
+      worklist.append(succ_begin(B), succ_end(B));
+    }
   }
-  DEBUG(errs() << "\n");
+}
 
-  return false;
+bool InstructionMixAnalysis::isDivergentBranch(Instruction *I, DivergenceAnalysis *DA) {
+  auto BR = dyn_cast<BranchInst>(I);
+  return DA && BR && BR->isConditional() && DA->isDivergent(BR->getCondition());
 }
 
 void InstructionMixAnalysis::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<DivergenceAnalysis>();
   AU.setPreservesAll();
 }
 
@@ -390,16 +450,17 @@ void InstructionMixAnalysis::pushInstructionsForCall(CallInst* CI, vector<FuncUn
   }
 }
 
-double InstructionMixAnalysis::getOveruseRate(array<unsigned long, FuncUnit::NumFuncUnits>& usage) {
-  long total = 0;
+double InstructionMixAnalysis::getOveruseRate(array<unsigned long, FuncUnit::NumFuncUnits> const &usage) {
+  double total = 0;
   for(int i = 0; i < FuncUnit::NumFuncUnits; i++) {
     total += usage[i];
   }
 
   double overuseRate = 0.0;
-  for(int i = 0; i < FuncUnit::NumFuncUnits; i++) {
+  // The -1 is because Pseudo instructions have no functional units
+  for(int i = 0; i < FuncUnit::NumFuncUnits - 1; i++) {
     double observed = usage[i]/total;
-    double ideal = sm_35[i]/256;
+    double ideal = sm_35[i]/256.0;
     if(observed > ideal)
       overuseRate += observed/ideal;
   }
@@ -1,8 +1,11 @@
 #ifndef INSTRUCTION_MIX_ANALYSIS_H
 #define INSTRUCTION_MIX_ANALYSIS_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/DivergenceAnalysis.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/PostDominators.h"
 
 #include <array>
 #include <vector>
@@ -39,21 +42,44 @@ namespace llvm {
       InstructionMixAnalysis() : LoopPass(ID) {}
 
       /**
-       * Returns the rate of overuse
+       * Returns the rate of overuse: the sum, over units used beyond their
+       * share of sm_35 throughput, of used share / ideal share
        */
-      double getOveruseRate(array<unsigned long, FuncUnit::NumFuncUnits>& usage);
+      static double getOveruseRate(array<unsigned long, FuncUnit::NumFuncUnits> const &usage);
+
+      /**
+       * Computes the mix of the loop as it currently stands, weighting each
+       * block by its frequency when BFI is given. Unlike a static estimate,
+       * this sees fused multiply-adds and eliminated casts.
+       *
+       * With DA, the mix counts warp issues rather than thread instructions:
+       * a divergent branch also issues its reconvergence, and the warp issues
+       * both sides of it. With BFI and PDT, every block of the divergent
+       * region, up to the branch's immediate post-dominator, is therefore
+       * weighted at least as heavily as the branch.
+       *
+       * Like all classification here, this keeps no state and is safe to
+       * call from any thread.
+       */
+      static array<unsigned long, FuncUnit::NumFuncUnits> computeUsage(Loop *L, BlockFrequencyInfo *BFI, DivergenceAnalysis *DA,
+                                                                 PostDominatorTree *PDT);
+
+      static bool isDivergentBranch(Instruction *I, DivergenceAnalysis *DA);
 
       void getAnalysisUsage(AnalysisUsage &AU) const override;
       bool runOnLoop(Loop *l, LPPassManager &LPM) override;
-      array<unsigned long, FuncUnit::NumFuncUnits> const &getUsage() const { return usage; }
-    private:
-      array<unsigned long, FuncUnit::NumFuncUnits> usage;
 
-      vector<FuncUnit> unitForInst(Instruction *i);
-      bool canFuseMultAdd(BinaryOperator *add);
-      bool canBitfieldExtract(BinaryOperator *andi);
-      void pushInstructionsForCall(CallInst* CI, vector<FuncUnit>& units);
-      void pushInstructionsForGEP(GetElementPtrInst* GEP, vector<FuncUnit>& units);
+      /**
+       * Returns the functional units a single issue of i occupies
+       */
+      static vector<FuncUnit> unitForInst(Instruction *i);
+    private:
+      static void weighDivergentRegions(Loop *L, BlockFrequencyInfo *BFI, DivergenceAnalysis *DA,
+                                        PostDominatorTree *PDT, DenseMap<BasicBlock*, uint64_t> &weights);
+      static bool canFuseMultAdd(BinaryOperator *add);
+      static bool canBitfieldExtract(BinaryOperator *andi);
+      static void pushInstructionsForCall(CallInst* CI, vector<FuncUnit>& units);
+      static void pushInstructionsForGEP(GetElementPtrInst* GEP, vector<FuncUnit>& units);
   };
 } // end namespace
 #endif
@@ -1,3 +1,5 @@
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 
 #include "llvm/IR/IRBuilder.h"
@@ -9,13 +11,77 @@
 
 using namespace llvm;
 
+/**** TransformationJournal ****/
+void TransformationJournal::insert(Instruction *I) {
+  inserted.push_back(I);
+}
+
+void TransformationJournal::replaceAllUsesWith(Instruction *From, Value *To) {
+  while (!From->use_empty()) {
+    Use &U = *From->use_begin();
+    replaced.push_back(make_pair(&U, (Value*) From));
+    U.set(To);
+  }
+}
+
+void TransformationJournal::remove(Instruction *I) {
+  Removal R = {I, I->getParent(), I->getNextNode()};
+  I->removeFromParent();
+  removed.push_back(R);
+}
+
+void TransformationJournal::commit() {
+  // Removed instructions may still reference each other, so drop every
+  // reference before deleting any of them
+  for (Removal &R : removed)
+    R.I->dropAllReferences();
+  for (Removal &R : removed)
+    R.I->deleteValue();
+
+  inserted.clear();
+  replaced.clear();
+  removed.clear();
+}
+
+void TransformationJournal::rollback() {
+  // Relink removed instructions in reverse order, so that every recorded
+  // insertion point is back in the block when it is used
+  for (auto R = removed.rbegin(), E = removed.rend(); R != E; ++R) {
+    if (R->Next)
+      R->I->insertBefore(R->Next);
+    else
+      R->BB->getInstList().push_back(R->I);
+  }
+
+  for (auto U = replaced.rbegin(), E = replaced.rend(); U != E; ++U)
+    U->first->set(U->second);
+
+  // Nothing outside the journal uses the new instructions anymore
+  for (Instruction *I : inserted)
+    I->dropAllReferences();
+  for (auto I = inserted.rbegin(), E = inserted.rend(); I != E; ++I)
+    (*I)->eraseFromParent();
+
+  inserted.clear();
+  replaced.clear();
+  removed.clear();
+}
+
+/**** Transformation ****/
+// ShrToDiv is left out until its rewrite is implemented
+vector<const Transformation*> const &Transformation::getRegistry() {
+  static const vector<const Transformation*> registry = {new ShlToMul, new MulToShl, new Cvt32ToCvt64,
+                                                          new Cvt64ToCvt32, new Fp64ToFp32};
+  return registry;
+}
+
 /**** ShlToMul ****/
 ShlToMul::ShlToMul() : Transformation() {
   usageChange[FuncUnit::Shift] = -1;
   usageChange[FuncUnit::IntMul] = 1;
 }
 
-void ShlToMul::applyTransformation(Instruction *I) {
+void ShlToMul::applyTransformation(Instruction *I, TransformationJournal &J) const {
 
     BinaryOperator *op = dyn_cast<BinaryOperator>(&*I);
     IRBuilder<> builder(op);
@@ -28,16 +94,14 @@ void ShlToMul::applyTransformation(Instruction *I) {
     Value *op2New = ConstantInt::get(op2->getType(), 1 << op2Value);
 
     Value *mul = builder.CreateMul(op1, op2New, "", hasNUW, hasNSW);
+    if (auto mulInst = dyn_cast<Instruction>(mul))
+      J.insert(mulInst);
 
-    for (auto &U : op->uses()) {
-      User *user = U.getUser();
-      user->setOperand(U.getOperandNo(), mul);
-    }
-
-    I->eraseFromParent();
+    J.replaceAllUsesWith(I, mul);
+    J.remove(I);
   };
 
-bool ShlToMul::canTransform(Instruction *I) {
+bool ShlToMul::canTransform(Instruction *I) const {
   if (dyn_cast<ShlOperator>(I) && dyn_cast<ConstantInt>(I->getOperand(1))) {
     return true;
   }
@@ -52,11 +116,11 @@ ShrToDiv::ShrToDiv() : Transformation() {
   usageChange[FuncUnit::IntMul] = 1;
 }
 
-void ShrToDiv::applyTransformation(Instruction *I) {
+void ShrToDiv::applyTransformation(Instruction *I, TransformationJournal &J) const {
   errs() << "ShrToDiv\n";
 };
 
-bool ShrToDiv::canTransform(Instruction *I) {
+bool ShrToDiv::canTransform(Instruction *I) const {
   if (dyn_cast<AShrOperator>(I) || dyn_cast<LShrOperator>(I))
     return true;
   return false;
@@ -68,7 +132,7 @@ MulToShl::MulToShl() : Transformation() {
   usageChange[FuncUnit::IntMul] = -1;
 }
 
-void MulToShl::applyTransformation(Instruction *I) {
+void MulToShl::applyTransformation(Instruction *I, TransformationJournal &J) const {
 
     IRBuilder<> builder(I);
     Value *op1 = I->getOperand(0);
@@ -80,16 +144,14 @@ void MulToShl::applyTransformation(Instruction *I) {
     Value *op2New = ConstantInt::get(op2->getType(), log2(op2Value));
 
     Value *shl = builder.CreateShl(op1, op2New, "", hasNUW, hasNSW);
+    if (auto shlInst = dyn_cast<Instruction>(shl))
+      J.insert(shlInst);
 
-    for (auto &U : I->uses()) {
-      User *user = U.getUser();
-      user->setOperand(U.getOperandNo(), shl);
-    }
-
-    I->eraseFromParent();
+    J.replaceAllUsesWith(I, shl);
+    J.remove(I);
   };
 
-bool MulToShl::canTransform(Instruction *I) {
+bool MulToShl::canTransform(Instruction *I) const {
   if (I->getOpcode() == BinaryOperator::Mul) {
     /* Check if operand is constant and power of two */
     if (ConstantInt *op = dyn_cast<ConstantInt>(I->getOperand(1))) {
@@ -110,7 +172,7 @@ Cvt32ToCvt64::Cvt32ToCvt64() : Transformation() {
   usageChange[FuncUnit::FP64] = 1;
 }
 
-void Cvt32ToCvt64::applyTransformation(Instruction *I) {
+void Cvt32ToCvt64::applyTransformation(Instruction *I, TransformationJournal &J) const {
 
   // Preconditions
   assert(I->getType()->isFloatTy());
@@ -144,7 +206,7 @@ void Cvt32ToCvt64::applyTransformation(Instruction *I) {
                                       nullptr)) {
       op1=c1->getOperand(0);
       co1=(Instruction::CastOps) op;
-      if(c1->getNumUses() > 1)
+      if(c1->getNumUses() == 1)
         rm.push_back(c1);
     }
   }
@@ -160,7 +222,7 @@ void Cvt32ToCvt64::applyTransformation(Instruction *I) {
                                       nullptr)) {
       op2=c2->getOperand(0);
       co2=(Instruction::CastOps) op;
-      if(c2->getNumUses() > 1)
+      if(c2->getNumUses() == 1)
         rm.push_back(c2);
     }
   }
@@ -172,17 +234,22 @@ void Cvt32ToCvt64::applyTransformation(Instruction *I) {
 
   Instruction *repl = CastInst::CreateFPCast(newI, fTy, "down_fp", I);
 
-  I->replaceAllUsesWith(repl);
-  rm.push_back(I);
+  J.insert(newOp1);
+  J.insert(newOp2);
+  J.insert(newI);
+  J.insert(repl);
+
+  J.replaceAllUsesWith(I, repl);
+  J.remove(I);
 
+  // The original casts are dead once their only user is gone
   while(!rm.empty()) {
-    Instruction *i = rm.back();
-    i->eraseFromParent();
+    J.remove(rm.back());
     rm.pop_back();
   }
 };
 
-bool Cvt32ToCvt64::canTransform(Instruction *I) {
+bool Cvt32ToCvt64::canTransform(Instruction *I) const {
   /* Is it an operation? */
   if (!isa<BinaryOperator>(I)){
     return false;
@@ -208,3 +275,133 @@ bool Cvt32ToCvt64::canTransform(Instruction *I) {
 
   return true;
 }
+
+/**** FP64 to FP32 helpers ****/
+static bool isNarrowableOp(Instruction *I) {
+  if (!isa<BinaryOperator>(I) || !I->getType()->isDoubleTy())
+    return false;
+
+  switch (I->getOpcode()) {
+    case Instruction::FAdd:
+    case Instruction::FSub:
+    case Instruction::FMul:
+    case Instruction::FDiv:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the float that V was extended from, if any
+static Value *floatSource(Value *V) {
+  if (auto ext = dyn_cast<FPExtInst>(V))
+    if (ext->getSrcTy()->isFloatTy())
+      return ext->getOperand(0);
+  return nullptr;
+}
+
+// Removes the extensions feeding I once I is their only user
+static void removeDeadExtensions(Instruction *I, TransformationJournal &J) {
+  for (unsigned i = 0; i < 2; i++) {
+    // x op x uses the same extension twice
+    if (i == 1 && I->getOperand(1) == I->getOperand(0))
+      break;
+    auto ext = dyn_cast<FPExtInst>(I->getOperand(i));
+    if (ext && all_of(ext->users(), [I](User *U) { return U == I; }))
+      J.remove(ext);
+  }
+}
+
+/**** Cvt64ToCvt32 ****/
+Cvt64ToCvt32::Cvt64ToCvt32() : Transformation() {
+  usageChange[FuncUnit::Conv64] = -3; /* two extensions and one truncation */
+  usageChange[FuncUnit::FP64] = -1;
+  usageChange[FuncUnit::FP32] = 1;
+}
+
+void Cvt64ToCvt32::applyTransformation(Instruction *I, TransformationJournal &J) const {
+  BinaryOperator *BO = cast<BinaryOperator>(I);
+
+  Instruction *newI = BinaryOperator::Create(BO->getOpcode(), floatSource(I->getOperand(0)),
+                                             floatSource(I->getOperand(1)), "down_fp", I);
+  newI->copyIRFlags(I);
+  J.insert(newI);
+
+  vector<Instruction*> truncs;
+  for (User *U : I->users())
+    truncs.push_back(cast<Instruction>(U));
+  for (Instruction *trunc : truncs) {
+    J.replaceAllUsesWith(trunc, newI);
+    J.remove(trunc);
+  }
+
+  removeDeadExtensions(I, J);
+  J.remove(I);
+}
+
+bool Cvt64ToCvt32::canTransform(Instruction *I) const {
+  if (!isNarrowableOp(I))
+    return false;
+
+  if (!floatSource(I->getOperand(0)) || !floatSource(I->getOperand(1)))
+    return false;
+
+  /* Is the result only ever truncated back to float? */
+  if (I->use_empty())
+    return false;
+  for (User *U : I->users()) {
+    auto trunc = dyn_cast<FPTruncInst>(U);
+    if (!trunc || !trunc->getDestTy()->isFloatTy())
+      return false;
+  }
+
+  return true;
+}
+
+/**** Fp64ToFp32 ****/
+Fp64ToFp32::Fp64ToFp32() : Transformation() {
+  usageChange[FuncUnit::FP64] = -1;
+  usageChange[FuncUnit::FP32] = 1;
+  usageChange[FuncUnit::Conv64] = 3; /* truncate both operands, extend the result */
+}
+
+void Fp64ToFp32::applyTransformation(Instruction *I, TransformationJournal &J) const {
+  BinaryOperator *BO = cast<BinaryOperator>(I);
+  Type *fTy = Type::getFloatTy(I->getContext());
+
+  // Operands that started out as floats need no conversion at all
+  Value *ops[2];
+  for (int i = 0; i < 2; i++) {
+    Value *op = I->getOperand(i);
+    if (Value *src = floatSource(op)) {
+      ops[i] = src;
+    } else if (auto C = dyn_cast<Constant>(op)) {
+      ops[i] = ConstantExpr::getFPTrunc(C, fTy);
+    } else {
+      Instruction *trunc = new FPTruncInst(op, fTy, "down_op", I);
+      J.insert(trunc);
+      ops[i] = trunc;
+    }
+  }
+
+  Instruction *newI = BinaryOperator::Create(BO->getOpcode(), ops[0], ops[1], "down_fp", I);
+  newI->copyIRFlags(I);
+  Instruction *repl = new FPExtInst(newI, I->getType(), "up_fp", I);
+  J.insert(newI);
+  J.insert(repl);
+
+  J.replaceAllUsesWith(I, repl);
+  removeDeadExtensions(I, J);
+  J.remove(I);
+}
+
+bool Fp64ToFp32::canTransform(Instruction *I) const {
+  if (!isNarrowableOp(I))
+    return false;
+
+  /* Does the IR permit reduced precision? */
+  if (I->hasUnsafeAlgebra())
+    return true;
+  Function *F = I->getFunction();
+  return F && F->getFnAttribute("unsafe-fp-math").getValueAsString() == "true";
+}
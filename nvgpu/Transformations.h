@@ -4,44 +4,119 @@
 using namespace std;
 
 namespace llvm {
+  /**
+   * Records the IR edits made by one or more transformations so that they
+   * can later be committed or undone. Removed instructions are only unlinked
+   * until commit, so a rollback restores the original IR exactly.
+   */
+  class TransformationJournal {
+    public:
+      ~TransformationJournal() { commit(); }
+
+      void insert(Instruction *I);
+      void replaceAllUsesWith(Instruction *From, Value *To);
+      void remove(Instruction *I);
+
+      void commit();
+      void rollback();
+    private:
+      struct Removal {
+        Instruction *I;
+        BasicBlock *BB;
+        Instruction *Next;
+      };
+
+      vector<Instruction*> inserted;
+      vector<pair<Use*, Value*> > replaced;
+      vector<Removal> removed;
+  };
+
   class Transformation {
     public:
       Transformation() {
         for (int i = 0; i < FuncUnit::NumFuncUnits; i++)
           usageChange[i] = 0;
       }
-      virtual void applyTransformation(Instruction *I) = 0;
-      virtual bool canTransform(Instruction *I) = 0;
+      virtual ~Transformation() {}
+      virtual void applyTransformation(Instruction *I, TransformationJournal &J) const = 0;
+      virtual bool canTransform(Instruction *I) const = 0;
+      virtual const char *getName() const = 0;
       array<int, FuncUnit::NumFuncUnits> usageChange;
+
+      /**
+       * All transformations, in the order the balancer tries them. The
+       * registry is built once and never modified, so any number of
+       * threads may share it.
+       */
+      static vector<const Transformation*> const &getRegistry();
   };
 
   class ShlToMul : public Transformation{
     public:
       ShlToMul();
-      void applyTransformation(Instruction *I) override;
-      bool canTransform(Instruction *I) override;
+      void applyTransformation(Instruction *I, TransformationJournal &J) const override;
+      bool canTransform(Instruction *I) const override;
+      const char *getName() const override { return "ShlToMul"; }
   };
 
   class ShrToDiv : public Transformation{
     public:
       ShrToDiv();
-      void applyTransformation(Instruction *I) override;
-      bool canTransform(Instruction *I) override;
+      void applyTransformation(Instruction *I, TransformationJournal &J) const override;
+      bool canTransform(Instruction *I) const override;
+      const char *getName() const override { return "ShrToDiv"; }
   };
 
   class MulToShl : public Transformation{
     public:
       MulToShl();
-      void applyTransformation(Instruction *I) override;
-      bool canTransform(Instruction *I) override;
+      void applyTransformation(Instruction *I, TransformationJournal &J) const override;
+      bool canTransform(Instruction *I) const override;
+      const char *getName() const override { return "MulToShl"; }
   };
 
-
+  /**
+   * Moves an FP32 operation on converted operands onto the FP64 units.
+   * Exact: the double result rounds to the same float.
+   */
   class Cvt32ToCvt64 : public Transformation{
     public:
       Cvt32ToCvt64();
-      void applyTransformation(Instruction *I) override;
-      bool canTransform(Instruction *I) override;
+      void applyTransformation(Instruction *I, TransformationJournal &J) const override;
+      bool canTransform(Instruction *I) const override;
+      const char *getName() const override { return "Cvt32ToCvt64"; }
+  };
+
+  /**
+   * The inverse of Cvt32ToCvt64: an FP64 add, sub, mul or div of two
+   * extended floats whose result is only truncated back to float is done in
+   * FP32 instead. Exact: double has more than 2*24+2 significand bits, so
+   * rounding to double and then to float gives the correctly rounded float
+   * result (Figueroa, "When is double rounding innocuous?", 1995).
+   */
+  class Cvt64ToCvt32 : public Transformation{
+    public:
+      Cvt64ToCvt32();
+      void applyTransformation(Instruction *I, TransformationJournal &J) const override;
+      bool canTransform(Instruction *I) const override;
+      const char *getName() const override { return "Cvt64ToCvt32"; }
+  };
+
+  /**
+   * Does an FP64 add, sub, mul or div in FP32, when the instruction carries
+   * unsafe-algebra fast-math flags or the function allows unsafe FP math.
+   * With u = 2^-24, the result has a relative error of at most 3u (+O(u^2))
+   * for mul and div, and an absolute error of at most u(|a|+|b|) + u|a+b|
+   * for add and sub, as long as operands and result are within float range;
+   * beyond it they overflow to infinity or lose precision as float
+   * denormals.
+   */
+  class Fp64ToFp32 : public Transformation{
+    public:
+      Fp64ToFp32();
+      void applyTransformation(Instruction *I, TransformationJournal &J) const override;
+      bool canTransform(Instruction *I) const override;
+      const char *getName() const override { return "Fp64ToFp32"; }
   };
 
 }